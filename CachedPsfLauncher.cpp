@@ -0,0 +1,116 @@
+#include "CachedPsfLauncher.h"
+#include "LightSheetParameters.h"
+#include "MVExceptions.h"
+
+#include <algorithm>
+
+using namespace microvolution;
+
+namespace decon {
+
+	CachedPsfLauncher::CachedPsfLauncher(DeconParameters& params, const float* psf)
+		: params(params), psfCached(false), psfReady(false)
+	{
+		launcher.SetCallbacks(Trace::TracedCallbacks::Iteration, Trace::TracedCallbacks::State, &traced);
+		if (psf && !params.generatePsf)
+			this->psf.assign(psf, psf + (size_t)params.psfNx * params.psfNy * std::max(params.psfNz, 1));
+	}
+
+	void CachedPsfLauncher::SetDevice(int dev)
+	{
+		launcher.SetDevice(dev);
+	}
+
+	void CachedPsfLauncher::SetCallbacks(IterationCallbackType callback, StateCallbackType stateCallback, void* pUserData)
+	{
+		traced.callback = callback;
+		traced.stateCallback = stateCallback;
+		traced.pUserData = pUserData;
+	}
+
+	bool CachedPsfLauncher::CanCachePsf() const
+	{
+		if (dynamic_cast<const LightSheetParameters*>(&params))
+			return false;
+		return params.xTiles <= 1 && params.yTiles <= 1 && params.zTiles <= 1;
+	}
+
+	void CachedPsfLauncher::PreparePsf()
+	{
+		if (params.generatePsf) {
+			if (CanCachePsf()) {
+				// Generated PSF matches the image grid unless the caller asked otherwise
+				cachedParams = params;
+				if (cachedParams.psfNx <= 0) cachedParams.psfNx = params.nx;
+				if (cachedParams.psfNy <= 0) cachedParams.psfNy = params.ny;
+				if (cachedParams.psfNz <= 0) cachedParams.psfNz = std::max(params.nz, 1);
+				if (cachedParams.psfDr <= 0) cachedParams.psfDr = params.dr;
+				if (cachedParams.psfDz <= 0) cachedParams.psfDz = params.dz;
+
+				psf.resize((size_t)cachedParams.psfNx * cachedParams.psfNy * cachedParams.psfNz);
+				Trace::MakePSF(launcher, cachedParams, psf.data());
+				cachedParams.generatePsf = false;
+				psfCached = true;
+			}
+		}
+		else if (psf.empty()) {
+			throw microvolution_exception("CachedPsfLauncher: no PSF supplied and DeconParameters::generatePsf is false", MicrovolutionError::noPSF);
+		}
+		psfReady = true;
+	}
+
+	void CachedPsfLauncher::Run(float* img)
+	{
+		Trace::Scope timepoint("timepoint", "decon", Timepoints());
+		if (!psfReady)
+			PreparePsf();
+
+		const size_t voxels = (size_t)params.nx * params.ny * std::max(params.nz, 1);
+		{
+			// Same parameters every timepoint: SetParameters only swaps the image and PSF buffers
+			Trace::Scope scope("SetParameters");
+			launcher.SetParameters(psfCached ? cachedParams : params, img, psf.empty() ? nullptr : psf.data());
+			Trace::Bytes("bytes to launcher", (int64_t)((voxels + psf.size()) * sizeof(float)));
+		}
+		Trace::Run(launcher);
+
+		std::vector<int> last = launcher.LastRunIterations();
+		iterations.push_back(last.empty() ? params.iterations : *std::max_element(last.begin(), last.end()));
+	}
+
+	void CachedPsfLauncher::RetrieveImage(float* ptr)
+	{
+		Trace::RetrieveImage(launcher, params, ptr);
+	}
+
+	void CachedPsfLauncher::RetrieveImageSlice(int i, float* ptr)
+	{
+		Trace::RetrieveImageSlice(launcher, params, i, ptr);
+	}
+
+	void CachedPsfLauncher::RetrieveImageSlice(int i, uint16_t* ptr)
+	{
+		Trace::RetrieveImageSlice(launcher, params, i, ptr);
+	}
+
+	void CachedPsfLauncher::RetrieveImageSlice(int i, uint8_t* ptr)
+	{
+		Trace::RetrieveImageSlice(launcher, params, i, ptr);
+	}
+
+	int CachedPsfLauncher::Timepoints() const
+	{
+		return (int)iterations.size();
+	}
+
+	const std::vector<int>& CachedPsfLauncher::Iterations() const
+	{
+		return iterations;
+	}
+
+	DeconvolutionLauncher& CachedPsfLauncher::Launcher()
+	{
+		return launcher;
+	}
+
+} /* namespace decon */
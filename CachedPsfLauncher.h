@@ -0,0 +1,76 @@
+#pragma once
+
+#include <vector>
+#include <stdint.h>
+
+#include "DeconvolutionLauncher.h"
+#include "DeconvolutionParameters.h"
+#include "Trace.h"
+
+namespace decon {
+
+	/*! @brief Run a series of same-shaped volumes through one launcher, generating the PSF only once.
+
+	  Intended for time-lapses where every timepoint shares one set of parameters. This is launcher and PSF reuse,
+	  not a warm start: every timepoint still starts Richardson-Lucy from scratch, as the library has no entry point
+	  for seeding the estimate with the previous result.
+
+	  When DeconParameters::generatePsf is set, the PSF is made once with MakePSF() on the first timepoint, and a
+	  private copy of the parameters with generatePsf cleared hands it to the launcher as an empirical PSF from then
+	  on. The caller's parameters are never modified. The PSF is not cached, and the launcher generates it itself as
+	  with plain DeconvolutionLauncher::SetParameters(), for:
+	  - LightSheetParameters, where passing the MakePSF() output back might apply the light-sheet illumination twice;
+	  - subvolume tiling (any of xTiles, yTiles, zTiles above 1), where the launcher expects a PSF the size of a tile.
+	*/
+	class CachedPsfLauncher {
+	public:
+		/*!
+		  @param params Parameters shared by all timepoints. Held by reference and must outlive this object.
+		  A cached PSF is built from their values at the first Run().
+		  @param psf Empirical PSF of psfNx*psfNy*psfNz floats, copied on construction. Ignored when generating a PSF.
+		*/
+		explicit CachedPsfLauncher(microvolution::DeconParameters& params, const float* psf = nullptr);
+
+		//! Passed through to DeconvolutionLauncher::SetDevice(). Call before the first Run().
+		void SetDevice(int dev);
+		//! Passed through to DeconvolutionLauncher::SetCallbacks().
+		void SetCallbacks(microvolution::IterationCallbackType callback, microvolution::StateCallbackType stateCallback, void* pUserData);
+
+		/*! @brief Deconvolve the next timepoint.
+
+		  @param[in] img nx*ny*nz floats. The launcher may use this buffer directly, so it must stay valid until Run() returns.
+		*/
+		void Run(float* img);
+
+		//! Copy the latest result; see DeconvolutionLauncher::RetrieveImage() and RetrieveImageSlice().
+		///@{
+		void RetrieveImage(float* ptr);
+		void RetrieveImageSlice(int i, float* ptr);
+		void RetrieveImageSlice(int i, uint16_t* ptr);
+		void RetrieveImageSlice(int i, uint8_t* ptr);
+		///@}
+
+		//! Number of timepoints run so far.
+		int Timepoints() const;
+
+		//! Iterations used by each timepoint, as reported by DeconvolutionLauncher::LastRunIterations().
+		const std::vector<int>& Iterations() const;
+
+		microvolution::DeconvolutionLauncher& Launcher();
+
+	private:
+		bool CanCachePsf() const;
+		void PreparePsf();
+
+		microvolution::DeconvolutionLauncher launcher;
+		microvolution::DeconParameters& params;
+		microvolution::DeconParameters cachedParams;	//!< Handed to the launcher once the generated PSF is cached
+		Trace::TracedCallbacks traced;
+
+		std::vector<float> psf;
+		std::vector<int> iterations;
+		bool psfCached;
+		bool psfReady;
+	};
+
+} /* namespace decon */
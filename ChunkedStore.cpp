@@ -0,0 +1,252 @@
+#include "ChunkedStore.h"
+#include "MVExceptions.h"
+#include "Trace.h"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+#include <zlib.h>
+
+using namespace microvolution;
+
+namespace decon {
+
+	namespace {
+		//! Chunk keys are "t.z.y.x", four dot-separated indices.
+		bool isChunkKey(const std::string& name)
+		{
+			int fields = 1;
+			bool digit = false;
+			for (char c : name) {
+				if (c == '.') {
+					if (!digit)
+						return false;
+					++fields;
+					digit = false;
+				}
+				else if (c >= '0' && c <= '9')
+					digit = true;
+				else
+					return false;
+			}
+			return digit && fields == 4;
+		}
+	}
+
+	ChunkedStore::ChunkedStore(const std::string& path, int nt, int nz, int ny, int nx, int cz, int cy, int cx, int threads, int level, int maxSlabs)
+		: path(path), nt(nt), nz(std::max(nz, 1)), ny(ny), nx(nx),
+		  cz(std::max(1, std::min(cz, std::max(nz, 1)))), cy(std::max(1, std::min(cy, ny))), cx(std::max(1, std::min(cx, nx))),
+		  level(level), maxSlabs(std::max(maxSlabs, 1)), busy(0), inFlight(0), stopping(false)
+	{
+		if (nt <= 0 || ny <= 0 || nx <= 0)
+			throw microvolution_exception("ChunkedStore: array shape must be positive", MicrovolutionError::badDimensionX);
+		if (level < -1 || level > 9)
+			throw microvolution_exception("ChunkedStore: zlib compression level must be -1 to 9", MicrovolutionError::unspecified);
+
+		std::filesystem::create_directories(path);
+		// Chunks of an earlier array would otherwise show through wherever this one is not written
+		for (auto& entry : std::filesystem::directory_iterator(path))
+			if (entry.is_regular_file() && isChunkKey(entry.path().filename().string()))
+				std::filesystem::remove(entry.path());
+		WriteMetadata();
+
+		if (threads <= 0)
+			threads = std::max(1u, std::thread::hardware_concurrency());
+		for (int i = 0; i < threads; ++i)
+			workers.emplace_back(&ChunkedStore::Worker, this);
+	}
+
+	ChunkedStore::~ChunkedStore()
+	{
+		try {
+			Flush();
+		}
+		catch (...) {
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		queueCv.notify_all();
+		for (auto& w : workers)
+			w.join();
+	}
+
+	void ChunkedStore::WriteMetadata()
+	{
+		std::ofstream f(path + "/.zarray", std::ios::binary | std::ios::trunc);
+		f << "{\n"
+		  << "    \"chunks\": [1, " << cz << ", " << cy << ", " << cx << "],\n"
+		  << "    \"compressor\": {\"id\": \"zlib\", \"level\": " << level << "},\n"
+		  << "    \"dimension_separator\": \".\",\n"
+		  << "    \"dtype\": \"<u2\",\n"
+		  << "    \"fill_value\": 0,\n"
+		  << "    \"filters\": null,\n"
+		  << "    \"order\": \"C\",\n"
+		  << "    \"shape\": [" << nt << ", " << nz << ", " << ny << ", " << nx << "],\n"
+		  << "    \"zarr_format\": 2\n"
+		  << "}\n";
+		if (!f)
+			throw microvolution_exception("ChunkedStore: could not write " + path + "/.zarray", MicrovolutionError::unspecified);
+	}
+
+	uint16_t* ChunkedStore::SliceBuffer(int t, int z)
+	{
+		if (t < 0 || t >= nt || z < 0 || z >= nz)
+			throw microvolution_exception("ChunkedStore: slice index out of range", MicrovolutionError::badDimensionZ);
+
+		const int zc = z / cz;
+		auto key = std::make_pair(t, zc);
+		if (submitted.count(key))
+			throw microvolution_exception("ChunkedStore: slice written after its chunks were submitted", MicrovolutionError::badDimensionZ);
+
+		auto it = slabs.find(key);
+		if (it == slabs.end()) {
+			auto slab = std::make_shared<Slab>();
+			slab->data.assign((size_t)cz * ny * nx, 0);
+			slab->present.assign(cz, false);
+			slab->filled = 0;
+			slab->remaining = 0;
+			it = slabs.emplace(key, slab).first;
+		}
+		return &it->second->data[(size_t)(z - zc * cz) * ny * nx];
+	}
+
+	void ChunkedStore::CommitSlice(int t, int z)
+	{
+		const int zc = z / cz;
+		auto it = slabs.find(std::make_pair(t, zc));
+		Slab& slab = *it->second;
+		const int dz = z - zc * cz;
+		if (slab.present[dz])
+			return;
+		slab.present[dz] = true;
+
+		// Last slab of the array may be shallower than cz
+		if (++slab.filled == std::min(cz, nz - zc * cz)) {
+			Submit(t, zc, it->second);
+			submitted.insert(it->first);
+			slabs.erase(it);
+		}
+	}
+
+	void ChunkedStore::WriteSlice(int t, int z, const uint16_t* ptr)
+	{
+		std::memcpy(SliceBuffer(t, z), ptr, (size_t)ny * nx * sizeof(uint16_t));
+		CommitSlice(t, z);
+	}
+
+	void ChunkedStore::WriteVolume(int t, DeconvolutionLauncher& launcher, const DeconParameters& params)
+	{
+		if (params.scaling != Scaling::U16)
+			throw microvolution_exception("ChunkedStore: DeconParameters::scaling must be Scaling::U16", MicrovolutionError::badScaling);
+		if (params.nx != nx || params.ny != ny || std::max(params.nz, 1) != nz)
+			throw microvolution_exception("ChunkedStore: image dimensions do not match store", MicrovolutionError::badDimensionX);
+
+		// Straight into the slab buffer, no intermediate copy
+		for (int z = 0; z < nz; ++z) {
+			Trace::RetrieveImageSlice(launcher, params, z, SliceBuffer(t, z));
+			CommitSlice(t, z);
+		}
+	}
+
+	void ChunkedStore::Submit(int t, int zc, const std::shared_ptr<Slab>& slab)
+	{
+		const int nyc = (ny + cy - 1) / cy;
+		const int nxc = (nx + cx - 1) / cx;
+		{
+			// Backpressure: bound the slab buffers held for encoding
+			std::unique_lock<std::mutex> lock(mutex);
+			idleCv.wait(lock, [this]() { return inFlight < maxSlabs; });
+			++inFlight;
+			slab->remaining = nyc * nxc;
+			for (int yc = 0; yc < nyc; ++yc)
+				for (int xc = 0; xc < nxc; ++xc)
+					queue.push_back(Job{ slab, t, zc, yc, xc });
+		}
+		queueCv.notify_all();
+	}
+
+	void ChunkedStore::EncodeChunk(int t, int zc, int yc, int xc, const Slab& slab)
+	{
+		Trace::Scope scope("EncodeChunk", "store");
+
+		// Zarr v2 stores edge chunks at full size, padded with fill_value
+		std::vector<uint16_t> chunk((size_t)cz * cy * cx, 0);
+		const int y0 = yc * cy, x0 = xc * cx;
+		const int h = std::min(cy, ny - y0), w = std::min(cx, nx - x0);
+		for (int z = 0; z < cz; ++z)
+			for (int y = 0; y < h; ++y)
+				std::memcpy(&chunk[((size_t)z * cy + y) * cx], &slab.data[((size_t)z * ny + y0 + y) * nx + x0], (size_t)w * sizeof(uint16_t));
+
+		const uLong srcLen = (uLong)(chunk.size() * sizeof(uint16_t));
+		uLongf dstLen = compressBound(srcLen);
+		std::vector<Bytef> dst(dstLen);
+		if (compress2(dst.data(), &dstLen, reinterpret_cast<const Bytef*>(chunk.data()), srcLen, level) != Z_OK)
+			throw microvolution_exception("ChunkedStore: zlib compression failed", MicrovolutionError::unspecified);
+
+		std::ostringstream name;
+		name << path << "/" << t << "." << zc << "." << yc << "." << xc;
+		std::ofstream f(name.str(), std::ios::binary | std::ios::trunc);
+		f.write(reinterpret_cast<const char*>(dst.data()), dstLen);
+		if (!f)
+			throw microvolution_exception("ChunkedStore: could not write " + name.str(), MicrovolutionError::unspecified);
+		Trace::Bytes("bytes written", (int64_t)dstLen);
+	}
+
+	void ChunkedStore::Worker()
+	{
+		Trace::SetThreadName("chunk encoder");
+		for (;;) {
+			Job job;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				queueCv.wait(lock, [this]() { return stopping || !queue.empty(); });
+				if (queue.empty())
+					return;
+				job = std::move(queue.front());
+				queue.pop_front();
+				++busy;
+			}
+
+			try {
+				EncodeChunk(job.t, job.zc, job.yc, job.xc, *job.slab);
+			}
+			catch (...) {
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!error)
+					error = std::current_exception();
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				--busy;
+				if (--job.slab->remaining == 0)
+					--inFlight;
+			}
+			job.slab.reset();
+			idleCv.notify_all();
+		}
+	}
+
+	void ChunkedStore::Flush()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		idleCv.wait(lock, [this]() { return queue.empty() && busy == 0; });
+		if (error) {
+			std::exception_ptr e = error;
+			error = nullptr;
+			std::rethrow_exception(e);
+		}
+		if (!slabs.empty()) {
+			std::ostringstream msg;
+			msg << "ChunkedStore: " << slabs.size() << " slab(s) still missing slices, e.g. t=" << slabs.begin()->first.first
+				<< " z chunk " << slabs.begin()->first.second;
+			throw microvolution_exception(msg.str(), MicrovolutionError::badDimensionZ);
+		}
+	}
+
+} /* namespace decon */
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+
+#include "DeconvolutionLauncher.h"
+
+namespace decon {
+
+	/*! @brief Chunked, zlib-compressed uint16 output store in Zarr v2 layout on the local filesystem.
+
+	  The array is 4D (t, z, y, x), little-endian "<u2", C order, with chunk files named "t.z.y.x".
+	  Slices are buffered per slab of chunk depth in Z; as soon as a slab is complete its chunks are encoded and
+	  written on a thread pool while the caller keeps retrieving the following slices. At most maxSlabs complete
+	  slabs wait for encoding at a time; beyond that, WriteSlice() blocks until the encoders catch up.
+	  Image data is expected to be Scaling::U16 output of the launcher.
+	*/
+	class ChunkedStore {
+	public:
+		/*!
+		  @param path Directory of the array; created if missing. An existing .zarray is overwritten and existing chunk
+		  files ("t.z.y.x") are deleted, so a rerun into the same directory never mixes in chunks of an earlier array.
+		  Other files in the directory are left alone.
+		  @param nt, nz, ny, nx Array shape
+		  @param cz, cy, cx Chunk shape; each chunk holds a single timepoint
+		  @param threads Encoder threads, 0 for std::thread::hardware_concurrency()
+		  @param level zlib compression level, 1 (fastest) to 9, 0 for none or -1 for the zlib default.
+		  Throws microvolution_exception before touching the directory if out of range.
+		  @param maxSlabs Complete slabs allowed to wait for encoding before WriteSlice() blocks
+		*/
+		ChunkedStore(const std::string& path, int nt, int nz, int ny, int nx, int cz = 32, int cy = 256, int cx = 256, int threads = 0, int level = 1, int maxSlabs = 2);
+		//! Waits for all pending chunks. Errors are only reported by Flush().
+		~ChunkedStore();
+
+		/*! @brief Add Z slice z of timepoint t, ny*nx values.
+
+		  Slices of a slab may arrive in any order; writing a slice again before its slab is complete replaces it.
+		  Throws if the slab holding the slice has already been submitted for encoding.
+		*/
+		void WriteSlice(int t, int z, const uint16_t* ptr);
+
+		/*! @brief Retrieve all slices of the last run from the launcher into timepoint t.
+
+		  Chunks of each completed slab are encoded while later slices are still being retrieved.
+		  Throws microvolution_exception (MicrovolutionError::badScaling) unless params.scaling is Scaling::U16.
+		*/
+		void WriteVolume(int t, microvolution::DeconvolutionLauncher& launcher, const microvolution::DeconParameters& params);
+
+		//! Block until every submitted chunk is on disk; rethrows the first encoding or I/O error,
+		//! and throws if any slab is still missing slices.
+		void Flush();
+
+	private:
+		struct Slab {
+			std::vector<uint16_t> data;	//!< cz*ny*nx, zero beyond the end of the array
+			std::vector<bool> present;	//!< Slices written so far
+			int filled;
+			int remaining;				//!< Chunks not yet encoded, guarded by mutex
+		};
+
+		struct Job {
+			std::shared_ptr<Slab> slab;
+			int t, zc, yc, xc;
+		};
+
+		void WriteMetadata();
+		//! Buffer for slice z of timepoint t inside its slab, creating the slab; throws if it was already submitted.
+		uint16_t* SliceBuffer(int t, int z);
+		//! Mark a slice filled through SliceBuffer() as present and submit its slab once complete.
+		void CommitSlice(int t, int z);
+		void Submit(int t, int zc, const std::shared_ptr<Slab>& slab);
+		void EncodeChunk(int t, int zc, int yc, int xc, const Slab& slab);
+		void Worker();
+
+		std::string path;
+		int nt, nz, ny, nx;
+		int cz, cy, cx;
+		int level;
+		int maxSlabs;
+
+		std::map<std::pair<int, int>, std::shared_ptr<Slab> > slabs;	//!< Partially filled slabs keyed by (t, z chunk)
+		std::set<std::pair<int, int> > submitted;						//!< Slabs handed to the encoders
+
+		std::vector<std::thread> workers;
+		std::deque<Job> queue;
+		std::mutex mutex;
+		std::condition_variable queueCv;
+		std::condition_variable idleCv;
+		int busy;
+		int inFlight;	//!< Submitted slabs with chunks still to encode
+		bool stopping;
+		std::exception_ptr error;
+	};
+
+} /* namespace decon */
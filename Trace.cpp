@@ -0,0 +1,296 @@
+#include "Trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+using namespace microvolution;
+
+namespace decon {
+	namespace Trace {
+
+		namespace detail {
+			std::atomic<bool> enabled(false);
+		}
+
+		namespace {
+
+			struct Event {
+				const char* name;
+				const char* cat;
+				char ph;		// 'X' span, 'C' counter
+				int64_t ts;
+				int64_t dur;
+				int64_t value;	// args.n for spans, byte delta for counters
+			};
+
+			struct ThreadBuffer {
+				int tid;
+				std::string name;
+				std::mutex mutex;	// uncontended except while Disable() drains the buffer
+				std::vector<Event> events;
+			};
+
+			struct Registry {
+				std::mutex mutex;
+				std::string path;
+				std::vector<std::shared_ptr<ThreadBuffer> > buffers;
+				int nextTid = 1;
+			};
+
+			Registry& registry()
+			{
+				static Registry r;
+				return r;
+			}
+
+			const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+
+			// Created on the first event of a thread; the registry keeps it until the thread has exited and it was exported
+			thread_local std::shared_ptr<ThreadBuffer> buffer;
+			thread_local const char* threadName = nullptr;
+
+			ThreadBuffer& local()
+			{
+				if (!buffer) {
+					buffer = std::make_shared<ThreadBuffer>();
+					if (threadName)
+						buffer->name = threadName;
+					Registry& r = registry();
+					std::lock_guard<std::mutex> lock(r.mutex);
+					buffer->tid = r.nextTid++;
+					r.buffers.push_back(buffer);
+				}
+				return *buffer;
+			}
+
+			void record(const Event& e)
+			{
+				ThreadBuffer& b = local();
+				std::lock_guard<std::mutex> lock(b.mutex);
+				b.events.push_back(e);
+			}
+
+			void writeString(std::ostream& out, const std::string& s)
+			{
+				out << '"';
+				for (char c : s) {
+					if (c == '"' || c == '\\')
+						out << '\\' << c;
+					else if ((unsigned char)c < 0x20)
+						out << ' ';
+					else
+						out << c;
+				}
+				out << '"';
+			}
+
+			//! Drop buffers whose thread has exited; registry lock held.
+			void prune(Registry& r)
+			{
+				r.buffers.erase(std::remove_if(r.buffers.begin(), r.buffers.end(),
+					[](const std::shared_ptr<ThreadBuffer>& b) { return b.use_count() == 1; }), r.buffers.end());
+			}
+
+			// Enables tracing from DECON_TRACE and writes the file at exit
+			struct EnvironmentTrace {
+				EnvironmentTrace()
+				{
+					// Construct the registry first so it outlives this object
+					registry();
+					const char* path = std::getenv("DECON_TRACE");
+					if (path && *path)
+						Enable(path);
+				}
+				~EnvironmentTrace()
+				{
+					Disable();
+				}
+			} environmentTrace;
+
+		}
+
+		void Enable(const std::string& path)
+		{
+			Registry& r = registry();
+			{
+				std::lock_guard<std::mutex> lock(r.mutex);
+				r.path = path;
+				prune(r);
+				for (auto& b : r.buffers) {
+					std::lock_guard<std::mutex> bufferLock(b->mutex);
+					b->events.clear();
+				}
+			}
+			detail::enabled.store(true);
+		}
+
+		void Disable()
+		{
+			if (!detail::enabled.exchange(false))
+				return;
+
+			Registry& r = registry();
+			std::lock_guard<std::mutex> lock(r.mutex);
+			std::ofstream out(r.path, std::ios::binary | std::ios::trunc);
+			if (!out) {
+				std::cerr << "decon trace: could not open " << r.path << " for writing, trace discarded" << std::endl;
+				for (auto& b : r.buffers) {
+					std::lock_guard<std::mutex> bufferLock(b->mutex);
+					b->events.clear();
+				}
+				prune(r);
+				return;
+			}
+
+			out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+			bool first = true;
+			auto sep = [&]() { out << (first ? "" : ",\n"); first = false; };
+
+			struct Count {
+				int64_t ts;
+				int tid;
+				const char* name;
+				int64_t delta;
+			};
+			std::vector<Count> counts;
+
+			for (auto& b : r.buffers) {
+				std::lock_guard<std::mutex> bufferLock(b->mutex);
+				if (!b->name.empty()) {
+					sep();
+					out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << b->tid << ",\"args\":{\"name\":";
+					writeString(out, b->name);
+					out << "}}";
+				}
+				for (const Event& e : b->events) {
+					if (e.ph == 'C') {
+						counts.push_back(Count{ e.ts, b->tid, e.name, e.value });
+						continue;
+					}
+					sep();
+					out << "{\"name\":";
+					writeString(out, e.name);
+					out << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << b->tid << ",\"ts\":" << e.ts << ",\"cat\":";
+					writeString(out, e.cat);
+					out << ",\"dur\":" << e.dur;
+					if (e.value >= 0)
+						out << ",\"args\":{\"n\":" << e.value << "}";
+					out << "}";
+				}
+				b->events.clear();
+			}
+
+			// Counters are recorded as per-thread deltas; turn them into running totals in time order
+			std::stable_sort(counts.begin(), counts.end(), [](const Count& a, const Count& b) { return a.ts < b.ts; });
+			std::map<std::string, int64_t> totals;
+			for (const Count& c : counts) {
+				sep();
+				out << "{\"name\":";
+				writeString(out, c.name);
+				out << ",\"ph\":\"C\",\"pid\":1,\"tid\":" << c.tid << ",\"ts\":" << c.ts
+					<< ",\"args\":{\"bytes\":" << (totals[c.name] += c.delta) << "}}";
+			}
+			out << "\n]}\n";
+
+			prune(r);
+		}
+
+		int64_t Now()
+		{
+			return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - epoch).count();
+		}
+
+		void SetThreadName(const char* name)
+		{
+			// Applied when the thread records its first event, so untraced threads never allocate a buffer
+			threadName = name;
+			if (buffer) {
+				std::lock_guard<std::mutex> lock(buffer->mutex);
+				buffer->name = name;
+			}
+		}
+
+		void Complete(const char* name, const char* cat, int64_t begin, int64_t end, int64_t n)
+		{
+			if (!Enabled())
+				return;
+			record(Event{ name, cat, 'X', begin, end - begin, n });
+		}
+
+		void Bytes(const char* name, int64_t delta)
+		{
+			if (!Enabled())
+				return;
+			record(Event{ name, "", 'C', Now(), 0, delta });
+		}
+
+		TracedCallbacks::TracedCallbacks()
+			: callback(nullptr), stateCallback(nullptr), pUserData(nullptr),
+			  iterationBegin(-1), subvolumeBegin(-1), stateBegin(-1), last{ -1, -1 }, lastState(DeconvolutionState::Init)
+		{
+		}
+
+		void TracedCallbacks::EndIteration(int64_t now)
+		{
+			if (iterationBegin >= 0)
+				Complete("iteration", "decon", iterationBegin, now, last.iteration);
+			iterationBegin = -1;
+		}
+
+		void TracedCallbacks::EndSubvolume(int64_t now)
+		{
+			if (subvolumeBegin >= 0)
+				Complete("subvolume", "decon", subvolumeBegin, now, last.subvolume);
+			subvolumeBegin = -1;
+		}
+
+		void TracedCallbacks::Iteration(DeconvolutionCallbackStruct s, void* p)
+		{
+			TracedCallbacks* self = static_cast<TracedCallbacks*>(p);
+			if (Enabled()) {
+				const int64_t now = Now();
+				self->EndIteration(now);
+				if (s.subvolume != self->last.subvolume) {
+					self->EndSubvolume(now);
+					self->subvolumeBegin = now;
+				}
+				self->iterationBegin = now;
+			}
+			self->last = s;
+
+			if (self->callback)
+				self->callback(s, self->pUserData);
+		}
+
+		void TracedCallbacks::State(DeconvolutionState::Type state, void* p)
+		{
+			static const char* const names[] = { "Init", "Running", "Cleanup", "Finished" };
+
+			TracedCallbacks* self = static_cast<TracedCallbacks*>(p);
+			if (Enabled()) {
+				const int64_t now = Now();
+				if (state != DeconvolutionState::Running) {
+					self->EndIteration(now);
+					self->EndSubvolume(now);
+				}
+				if (self->stateBegin >= 0)
+					Complete(names[self->lastState], "state", self->stateBegin, now);
+				self->stateBegin = state == DeconvolutionState::Finished ? -1 : now;
+			}
+			self->lastState = state;
+			if (state == DeconvolutionState::Init)
+				self->last = DeconvolutionCallbackStruct{ -1, -1 };
+
+			if (self->stateCallback)
+				self->stateCallback(state, self->pUserData);
+		}
+
+	} /* namespace Trace */
+} /* namespace decon */
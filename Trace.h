@@ -0,0 +1,146 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <stdint.h>
+
+#include "Callbacks.h"
+#include "DeconvolutionLauncher.h"
+
+namespace decon {
+
+	/*! @brief Lightweight event tracing with Chrome-trace / Perfetto JSON export.
+
+	  Tracing is off unless the DECON_TRACE environment variable names an output file at startup, or Enable() is called.
+	  When off, every entry point is a single relaxed atomic load. When on, events go to a per-thread buffer and are
+	  written as one JSON file (one track per thread) by Disable(), or at process exit when enabled through DECON_TRACE.
+
+	  Event, category and thread names must be string literals, or otherwise outlive the trace.
+	*/
+	namespace Trace {
+
+		namespace detail {
+			extern std::atomic<bool> enabled;
+		}
+
+		//! Start collecting events, to be written to path. Discards anything collected by an earlier Enable().
+		void Enable(const std::string& path);
+		//! Stop collecting and write the JSON file. Does nothing if tracing is off.
+		void Disable();
+
+		inline bool Enabled() { return detail::enabled.load(std::memory_order_relaxed); }
+
+		//! Microseconds on the trace clock.
+		int64_t Now();
+
+		//! Name the calling thread's track. Cheap when tracing is off: nothing is allocated until the thread records an event.
+		void SetThreadName(const char* name);
+
+		//! Record a span on the calling thread. n >= 0 is attached as args.n (e.g. iteration or subvolume index).
+		void Complete(const char* name, const char* cat, int64_t begin, int64_t end, int64_t n = -1);
+
+		//! Add delta to byte counter name. Only the delta is recorded; running totals are built when the trace is written.
+		void Bytes(const char* name, int64_t delta);
+
+		//! RAII span covering the lifetime of the object.
+		class Scope {
+		public:
+			Scope(const char* name, const char* cat = "decon", int64_t n = -1)
+				: name(name), cat(cat), n(n), begin(Enabled() ? Now() : -1) {}
+			~Scope() { if (begin >= 0) Complete(name, cat, begin, Now(), n); }
+
+			Scope(const Scope&) = delete;
+			Scope& operator=(const Scope&) = delete;
+
+		private:
+			const char* name;
+			const char* cat;
+			int64_t n;
+			int64_t begin;
+		};
+
+		/*! @brief Launcher callbacks that turn iteration/state notifications into spans, then forward to the user's callbacks.
+
+		  Install with launcher.SetCallbacks(TracedCallbacks::Iteration, TracedCallbacks::State, &traced).
+		  Each iteration is traced from its callback to the next one; subvolumes and DeconvolutionState phases likewise.
+		*/
+		struct TracedCallbacks {
+			TracedCallbacks();
+
+			microvolution::IterationCallbackType callback;
+			microvolution::StateCallbackType stateCallback;
+			void* pUserData;
+
+			static void Iteration(microvolution::DeconvolutionCallbackStruct s, void* p);
+			static void State(microvolution::DeconvolutionState::Type state, void* p);
+
+		private:
+			void EndIteration(int64_t now);
+			void EndSubvolume(int64_t now);
+
+			int64_t iterationBegin;
+			int64_t subvolumeBegin;
+			int64_t stateBegin;
+			microvolution::DeconvolutionCallbackStruct last;
+			microvolution::DeconvolutionState::Type lastState;
+		};
+
+		/*! @name Traced launcher calls
+
+		  Drop-in equivalents of the DeconvolutionLauncher calls, each recorded as a span (with the slice index as args.n)
+		  plus the bytes moved between host and launcher. Tile staging inside Run() shows up through TracedCallbacks.
+		*/
+		///@{
+		inline void SetParameters(microvolution::DeconvolutionLauncher& launcher, microvolution::DeconParameters& params)
+		{
+			Scope scope("SetParameters");
+			launcher.SetParameters(params);
+		}
+
+		inline void MakePSF(microvolution::DeconvolutionLauncher& launcher, microvolution::DeconParameters& params, float* psf)
+		{
+			Scope scope("MakePSF");
+			launcher.MakePSF(params, psf);
+		}
+
+		inline void Run(microvolution::DeconvolutionLauncher& launcher)
+		{
+			Scope scope("Run");
+			launcher.Run();
+		}
+
+		template <typename T>
+		void SetImageSlice(microvolution::DeconvolutionLauncher& launcher, const microvolution::DeconParameters& params, int i, T* ptr)
+		{
+			Scope scope("SetImageSlice", "transfer", i);
+			launcher.SetImageSlice(i, ptr);
+			Bytes("bytes to launcher", (int64_t)params.nx * params.ny * sizeof(T));
+		}
+
+		template <typename T>
+		void SetPsfSlice(microvolution::DeconvolutionLauncher& launcher, const microvolution::DeconParameters& params, int i, T* ptr)
+		{
+			Scope scope("SetPsfSlice", "transfer", i);
+			launcher.SetPsfSlice(i, ptr);
+			Bytes("bytes to launcher", (int64_t)params.psfNx * params.psfNy * sizeof(T));
+		}
+
+		template <typename T>
+		void RetrieveImageSlice(microvolution::DeconvolutionLauncher& launcher, const microvolution::DeconParameters& params, int i, T* ptr)
+		{
+			Scope scope("RetrieveImageSlice", "transfer", i);
+			launcher.RetrieveImageSlice(i, ptr);
+			Bytes("bytes from launcher", (int64_t)params.nx * params.ny * sizeof(T));
+		}
+
+		inline void RetrieveImage(microvolution::DeconvolutionLauncher& launcher, const microvolution::DeconParameters& params, float* ptr)
+		{
+			Scope scope("RetrieveImage", "transfer");
+			launcher.RetrieveImage(ptr);
+			Bytes("bytes from launcher", (int64_t)params.nx * params.ny * (params.nz > 1 ? params.nz : 1) * sizeof(float));
+		}
+		///@}
+
+	} /* namespace Trace */
+
+} /* namespace decon */
@@ -0,0 +1,499 @@
+#include "Licensing.h"
+#include "DeconvolutionLauncher.h"
+#include "MVExceptions.h"
+#include "Trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <complex>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+
+using namespace microvolution;
+
+/*
+  Synthetic-phantom accuracy and speed regression.
+
+  Usage: decon-regression <case> <baseline file>
+         decon-regression --calibrate <baseline file>
+
+  A case is named <psf>-<phantom>-<XxYxZ tiles>-<regularization>, e.g. widefield-beads-2x2x1-entropy.
+  The phantom is blurred with a PSF generated from the same DeconParameters used for deconvolution,
+  background and Poisson noise are added, and the result is deconvolved. The case fails if the
+  reconstruction error or the time per voxel per iteration exceeds the limits in the baseline file,
+  or if deconvolution does not improve on the error of the noisy input. A case that has not been
+  calibrated yet is skipped, as are runs without a license or GPU.
+
+  Time per iteration excludes setup: each case also runs with iterations = 0 (setup only, see
+  DeconParameters::iterations) and that time is subtracted. Both runs are repeated and the fastest kept.
+
+  --calibrate measures every case listed in the baseline file and rewrites its limits as
+  measured error + ERROR_TOLERANCE and measured time * TIME_TOLERANCE. If any case does not improve
+  on its input, nothing is written and it exits non-zero.
+
+  Set DECON_TRACE=<file> to also write a Chrome-trace/Perfetto trace of the case.
+
+  Exit codes: 0 pass, 1 fail, 77 skipped (no license or no usable GPU).
+*/
+
+static const int SKIP = 77;
+
+static const int NX = 128, NY = 128, NZ = 32;
+static const int ITERATIONS = 20;
+static const float PHOTONS = 200;		// Peak object intensity
+static const float BACKGROUND = 20;
+static const int REPEATS = 3;
+
+// Tolerance policy applied by --calibrate
+static const double ERROR_TOLERANCE = 0.02;	// Absolute
+static const double TIME_TOLERANCE = 1.2;	// Relative
+
+struct Case {
+	PSFType::Type psfType;
+	std::string phantom;
+	int xTiles, yTiles, zTiles;
+	RegularizationType::Type regularization;
+};
+
+static bool parseCase(const std::string& name, Case& c)
+{
+	std::vector<std::string> parts;
+	std::istringstream ss(name);
+	for (std::string part; std::getline(ss, part, '-');)
+		parts.push_back(part);
+	if (parts.size() != 4)
+		return false;
+
+	if (parts[0] == "widefield") c.psfType = PSFType::Widefield;
+	else if (parts[0] == "confocal") c.psfType = PSFType::Confocal;
+	else if (parts[0] == "twophoton") c.psfType = PSFType::TwoPhoton;
+	else return false;
+
+	c.phantom = parts[1];
+	if (c.phantom != "beads" && c.phantom != "filaments" && c.phantom != "shells")
+		return false;
+
+	char x1, x2;
+	std::istringstream tiles(parts[2]);
+	if (!(tiles >> c.xTiles >> x1 >> c.yTiles >> x2 >> c.zTiles) || x1 != 'x' || x2 != 'x')
+		return false;
+
+	if (parts[3] == "none") c.regularization = RegularizationType::None;
+	else if (parts[3] == "tv") c.regularization = RegularizationType::TV;
+	else if (parts[3] == "entropy") c.regularization = RegularizationType::Entropy;
+	else return false;
+
+	return true;
+}
+
+struct Limits {
+	bool calibrated;	//!< False while the baseline holds "-" placeholders
+	double maxError;
+	double maxTime;		//!< ns per voxel per iteration
+};
+
+//! Find limits for name; lines are "<case> <max error> <max ns per voxel per iteration>", '#' starts a comment.
+static bool readBaseline(const char* path, const std::string& name, Limits& limits)
+{
+	std::ifstream f(path);
+	for (std::string line; std::getline(f, line);) {
+		line = line.substr(0, line.find('#'));
+		std::istringstream ss(line);
+		std::string key, error, time;
+		if (!(ss >> key >> error >> time) || key != name)
+			continue;
+		limits.calibrated = error != "-" && time != "-";
+		limits.maxError = limits.calibrated ? std::stod(error) : 0;
+		limits.maxTime = limits.calibrated ? std::stod(time) : 0;
+		return true;
+	}
+	return false;
+}
+
+static DeconParameters makeParameters(const Case& c)
+{
+	DeconParameters params;
+	params.nx = NX;
+	params.ny = NY;
+	params.nz = NZ;
+	params.iterations = ITERATIONS;
+	params.xPadding = 16;
+	params.yPadding = 16;
+	params.zPadding = 8;
+	params.xTiles = c.xTiles;
+	params.yTiles = c.yTiles;
+	params.zTiles = c.zTiles;
+	params.lambda = c.psfType == PSFType::TwoPhoton ? 900 : 525;
+	params.dr = 100;
+	params.dz = 250;
+	params.NA = 1.2f;
+	params.RI = 1.33f;
+	params.ns = 1.33f;
+	params.pinhole = 500;
+	params.psfType = c.psfType;
+	params.psfModel = PSFModel::BornWolf;
+	params.generatePsf = true;
+	params.blind = false;
+	params.scaling = Scaling::None;
+	params.preFilter = PreFilter::None;
+	params.postFilter = PostFilter::None;
+	params.regularizationType = c.regularization;
+	params.regularization = c.regularization == RegularizationType::None ? 0 : -1;
+	params.background = BACKGROUND;
+	params.psfNx = NX;
+	params.psfNy = NY;
+	params.psfNz = NZ;
+	params.psfDr = params.dr;
+	params.psfDz = params.dz;
+	return params;
+}
+
+/* Phantoms, peak intensity 1. The margins keep every object entirely inside the volume. */
+
+static size_t idx(int x, int y, int z) { return ((size_t)z * NY + y) * NX + x; }
+
+//! Fill an ellipsoidal shell (or ball when inner == 0) at (cx, cy, cz); radii in lateral pixels.
+static void shell(std::vector<float>& img, float cx, float cy, float cz, float outer, float inner, float aspect)
+{
+	const int r = (int)std::ceil(outer);
+	const int rz = (int)std::ceil(outer / aspect);
+	for (int z = std::max(0, (int)cz - rz); z <= std::min(NZ - 1, (int)cz + rz); ++z)
+		for (int y = std::max(0, (int)cy - r); y <= std::min(NY - 1, (int)cy + r); ++y)
+			for (int x = std::max(0, (int)cx - r); x <= std::min(NX - 1, (int)cx + r); ++x) {
+				const float dx = x - cx, dy = y - cy, dz = (z - cz) * aspect;
+				const float d = std::sqrt(dx * dx + dy * dy + dz * dz);
+				if (d <= outer && d >= inner)
+					img[idx(x, y, z)] = 1;
+			}
+}
+
+static std::vector<float> makePhantom(const std::string& kind, float aspect)
+{
+	std::vector<float> img((size_t)NX * NY * NZ, 0);
+	std::mt19937 rng(1234);
+	const int margin = 16, zMargin = 8;
+	std::uniform_real_distribution<float> ux(margin, NX - margin), uy(margin, NY - margin), uz(zMargin, NZ - zMargin);
+
+	if (kind == "beads") {
+		for (int i = 0; i < 60; ++i)
+			shell(img, ux(rng), uy(rng), uz(rng), 1.5f, 0, aspect);
+	}
+	else if (kind == "filaments") {
+		for (int i = 0; i < 12; ++i) {
+			const float x0 = ux(rng), y0 = uy(rng), z0 = uz(rng);
+			const float x1 = ux(rng), y1 = uy(rng), z1 = uz(rng);
+			const int steps = 4 * (int)std::ceil(std::max(std::abs(x1 - x0), std::max(std::abs(y1 - y0), std::abs(z1 - z0))));
+			for (int s = 0; s <= steps; ++s) {
+				const float t = (float)s / steps;
+				img[idx((int)std::lround(x0 + t * (x1 - x0)), (int)std::lround(y0 + t * (y1 - y0)), (int)std::lround(z0 + t * (z1 - z0)))] = 1;
+			}
+		}
+	}
+	else {
+		std::uniform_real_distribution<float> radius(6, 12);
+		for (int i = 0; i < 6; ++i) {
+			const float r = radius(rng);
+			std::uniform_real_distribution<float> sx(margin + r, NX - margin - r), sy(margin + r, NY - margin - r);
+			shell(img, sx(rng), sy(rng), NZ / 2.0f, r, r - 1.5f, aspect);
+		}
+	}
+	return img;
+}
+
+/* Radix-2 FFT, used only to blur the phantom with the generated PSF. */
+
+static void fft(std::vector<std::complex<double> >& a, bool inverse)
+{
+	const double PI = std::acos(-1.0);	// M_PI is not standard C++
+	const size_t n = a.size();
+	for (size_t i = 1, j = 0; i < n; ++i) {
+		size_t bit = n >> 1;
+		for (; j & bit; bit >>= 1)
+			j ^= bit;
+		j ^= bit;
+		if (i < j)
+			std::swap(a[i], a[j]);
+	}
+	for (size_t len = 2; len <= n; len <<= 1) {
+		const double angle = 2 * PI / len * (inverse ? 1 : -1);
+		const std::complex<double> wl(std::cos(angle), std::sin(angle));
+		for (size_t i = 0; i < n; i += len) {
+			std::complex<double> w(1);
+			for (size_t k = 0; k < len / 2; ++k, w *= wl) {
+				const std::complex<double> u = a[i + k], v = a[i + k + len / 2] * w;
+				a[i + k] = u + v;
+				a[i + k + len / 2] = u - v;
+			}
+		}
+	}
+}
+
+static void fft3d(std::vector<std::complex<double> >& data, int nx, int ny, int nz, bool inverse)
+{
+	const int dims[3] = { nx, ny, nz };
+	const size_t strides[3] = { 1, (size_t)nx, (size_t)nx * ny };
+	for (int axis = 0; axis < 3; ++axis) {
+		const int n = dims[axis];
+		std::vector<std::complex<double> > line(n);
+		for (size_t base = 0; base < data.size(); ++base) {
+			// Visit each line once, from its first element
+			if ((base / strides[axis]) % n != 0)
+				continue;
+			for (int i = 0; i < n; ++i) line[i] = data[base + i * strides[axis]];
+			fft(line, inverse);
+			for (int i = 0; i < n; ++i) data[base + i * strides[axis]] = line[i];
+		}
+	}
+}
+
+/*! @brief Linear convolution of img with psf, normalized to unit sum and centred on its peak.
+
+  Both are zero-padded to twice the volume in every dimension before the FFT, so no blur wraps around the
+  borders (the PSF spans at most one volume), then the result is cropped back to NX*NY*NZ.
+*/
+static std::vector<float> blur(const std::vector<float>& img, const std::vector<float>& psf)
+{
+	const int PX = 2 * NX, PY = 2 * NY, PZ = 2 * NZ;
+	auto padded = [=](int x, int y, int z) { return ((size_t)z * PY + y) * PX + x; };
+
+	const size_t peak = std::max_element(psf.begin(), psf.end()) - psf.begin();
+	const int px = (int)(peak % NX), py = (int)(peak / NX % NY), pz = (int)(peak / ((size_t)NX * NY));
+	double sum = 0;
+	for (float v : psf) sum += v;
+
+	std::vector<std::complex<double> > a((size_t)PX * PY * PZ), b(a.size());
+	for (int z = 0; z < NZ; ++z)
+		for (int y = 0; y < NY; ++y)
+			for (int x = 0; x < NX; ++x) {
+				a[padded(x, y, z)] = img[idx(x, y, z)];
+				b[padded((x - px + PX) % PX, (y - py + PY) % PY, (z - pz + PZ) % PZ)] = psf[idx(x, y, z)] / sum;
+			}
+
+	fft3d(a, PX, PY, PZ, false);
+	fft3d(b, PX, PY, PZ, false);
+	for (size_t i = 0; i < a.size(); ++i)
+		a[i] *= b[i];
+	fft3d(a, PX, PY, PZ, true);
+
+	std::vector<float> out(img.size());
+	for (int z = 0; z < NZ; ++z)
+		for (int y = 0; y < NY; ++y)
+			for (int x = 0; x < NX; ++x)
+				out[idx(x, y, z)] = (float)std::max(0.0, a[padded(x, y, z)].real() / a.size());
+	return out;
+}
+
+//! Residual of the least-squares fit truth ~ a*estimate + b, relative to the spread of truth. 0 is perfect.
+static double reconstructionError(const std::vector<float>& truth, const std::vector<float>& estimate)
+{
+	const double n = (double)truth.size();
+	double st = 0, se = 0;
+	for (size_t i = 0; i < truth.size(); ++i) { st += truth[i]; se += estimate[i]; }
+	const double mt = st / n, me = se / n;
+
+	double cov = 0, var = 0, spread = 0;
+	for (size_t i = 0; i < truth.size(); ++i) {
+		cov += (estimate[i] - me) * (truth[i] - mt);
+		var += (estimate[i] - me) * (estimate[i] - me);
+		spread += (truth[i] - mt) * (truth[i] - mt);
+	}
+	const double a = var > 0 ? cov / var : 0;
+
+	double residual = 0;
+	for (size_t i = 0; i < truth.size(); ++i) {
+		const double r = truth[i] - mt - a * (estimate[i] - me);
+		residual += r * r;
+	}
+	return std::sqrt(residual / spread);
+}
+
+struct Measurement {
+	double error;		//!< reconstructionError() of the result
+	double inputError;	//!< reconstructionError() of the noisy input
+	double ns;			//!< Time per voxel per iteration, setup excluded
+};
+
+static Measurement measure(const Case& c)
+{
+	DeconParameters params = makeParameters(c);
+	DeconvolutionLauncher launcher;
+	decon::Trace::TracedCallbacks traced;
+	launcher.SetCallbacks(decon::Trace::TracedCallbacks::Iteration, decon::Trace::TracedCallbacks::State, &traced);
+
+	std::vector<float> psf((size_t)NX * NY * NZ);
+	decon::Trace::MakePSF(launcher, params, psf.data());
+
+	// Image = Poisson(blur(phantom) + background)
+	const std::vector<float> truth = makePhantom(c.phantom, params.dz / params.dr);
+	std::vector<float> image(truth.size());
+	for (size_t i = 0; i < truth.size(); ++i)
+		image[i] = PHOTONS * truth[i];
+	image = blur(image, psf);
+	std::mt19937 rng(42);
+	for (float& v : image)
+		v = (float)std::poisson_distribution<int>(v + BACKGROUND)(rng);
+
+	// Changing only the iteration count keeps SetParameters lightweight; the image is uploaded again each run
+	auto run = [&](int iterations) {
+		params.iterations = iterations;
+		decon::Trace::SetParameters(launcher, params);
+		for (int z = 0; z < NZ; ++z)
+			decon::Trace::SetImageSlice(launcher, params, z, &image[(size_t)z * NX * NY]);
+
+		const auto begin = std::chrono::steady_clock::now();
+		decon::Trace::Run(launcher);
+		return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count();
+	};
+
+	// Untimed setup-only run absorbs device and context initialization
+	run(0);
+
+	Measurement m;
+	std::vector<float> estimate(truth.size());
+	int ran = ITERATIONS;
+	double full = 1e300, setup = 1e300;
+	for (int r = 0; r < REPEATS; ++r) {
+		full = std::min(full, run(ITERATIONS));
+		if (r == 0) {
+			for (int z = 0; z < NZ; ++z)
+				decon::Trace::RetrieveImageSlice(launcher, params, z, &estimate[(size_t)z * NX * NY]);
+			std::vector<int> iterations = launcher.LastRunIterations();
+			if (!iterations.empty())
+				ran = *std::max_element(iterations.begin(), iterations.end());
+		}
+		setup = std::min(setup, run(0));
+	}
+
+	m.ns = std::max(0.0, full - setup) / ((double)truth.size() * std::max(ran, 1));
+	m.inputError = reconstructionError(truth, image);
+	m.error = reconstructionError(truth, estimate);
+	return m;
+}
+
+//! Measure every case in the baseline file and rewrite its limits by the tolerance policy. Comment lines are kept.
+//! The file is left untouched if any case fails to improve on its input.
+static int calibrate(const char* path)
+{
+	std::vector<std::string> lines;
+	{
+		std::ifstream f(path);
+		for (std::string line; std::getline(f, line);)
+			lines.push_back(line);
+	}
+	if (lines.empty()) {
+		std::cerr << "could not read " << path << std::endl;
+		return 1;
+	}
+
+	bool refused = false;
+	for (std::string& line : lines) {
+		std::istringstream ss(line.substr(0, line.find('#')));
+		std::string name;
+		Case c;
+		if (!(ss >> name) || !parseCase(name, c))
+			continue;
+
+		const Measurement m = measure(c);
+		if (!(m.error < m.inputError)) {
+			std::cout << name << ": error " << m.error << " does not improve on input error " << m.inputError << ", not calibrated" << std::endl;
+			refused = true;
+			continue;
+		}
+		std::ostringstream out;
+		// Errors to 3 decimals, times to 4 significant digits
+		out << name << std::string(name.size() < 35 ? 35 - name.size() : 1, ' ') << std::fixed << std::setprecision(3)
+			<< m.error + ERROR_TOLERANCE << "  " << std::defaultfloat << std::setprecision(4) << m.ns * TIME_TOLERANCE
+			<< "  # measured " << std::fixed << std::setprecision(3) << m.error << " " << std::defaultfloat << std::setprecision(4) << m.ns;
+		line = out.str();
+		std::cout << line << std::endl;
+	}
+	if (refused) {
+		std::cerr << path << " not written" << std::endl;
+		return 1;
+	}
+
+	std::ofstream f(path, std::ios::trunc);
+	for (const std::string& line : lines)
+		f << line << "\n";
+	return f ? 0 : 1;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc != 3) {
+		std::cerr << "usage: " << argv[0] << " <psf>-<phantom>-<XxYxZ>-<regularization> <baseline file>" << std::endl;
+		std::cerr << "       " << argv[0] << " --calibrate <baseline file>" << std::endl;
+		return 1;
+	}
+	const std::string name = argv[1];
+	const bool calibrating = name == "--calibrate";
+
+	Case c;
+	Limits limits;
+	if (!calibrating) {
+		if (!parseCase(name, c)) {
+			std::cerr << "bad case name: " << name << std::endl;
+			return 1;
+		}
+		if (!readBaseline(argv[2], name, limits)) {
+			std::cerr << "no baseline for " << name << " in " << argv[2] << std::endl;
+			return 1;
+		}
+		if (!limits.calibrated) {
+			std::cout << "no limits for " << name << ", skipping; run `cmake --build . --target regression-calibrate` on the reference node" << std::endl;
+			return SKIP;
+		}
+	}
+
+	Licensing* lic = Licensing::GetInstance();
+	if (const char* path = getenv("DECON_LICENSE_PATH"))
+		lic->SetPath(path);
+	lic->CheckoutLicenses();
+	if (!lic->HaveValidLicense("deconvolution")) {
+		std::cout << "no deconvolution license, skipping" << std::endl;
+		return SKIP;
+	}
+
+	try {
+		if (calibrating)
+			return calibrate(argv[2]);
+
+		const Measurement m = measure(c);
+
+		// Same layout as the baseline file
+		std::cout << name << "\t" << m.error << "\t" << m.ns << "\t# input error " << m.inputError << std::endl;
+
+		bool pass = true;
+		if (!(m.error < m.inputError)) {
+			std::cout << "FAIL: error " << m.error << " not below input error " << m.inputError << std::endl;
+			pass = false;
+		}
+		if (!(m.error <= limits.maxError)) {
+			std::cout << "FAIL: error " << m.error << " > " << limits.maxError << std::endl;
+			pass = false;
+		}
+		if (!(m.ns <= limits.maxTime)) {
+			std::cout << "FAIL: " << m.ns << " ns/voxel/iteration > " << limits.maxTime << std::endl;
+			pass = false;
+		}
+		return pass ? 0 : 1;
+	}
+	catch (microvolution_exception& e) {
+		std::cout << e.what() << std::endl;
+		switch (e.getError()) {
+		case MicrovolutionError::badDevice:
+		case MicrovolutionError::badDriver:
+		case MicrovolutionError::unlicensedDeconvolution:
+			return SKIP;
+		default:
+			return 1;
+		}
+	}
+}
@@ -0,0 +1,149 @@
+#include "CachedPsfLauncher.h"
+#include "LightSheetParameters.h"
+#include "MVExceptions.h"
+
+#include "Check.h"
+#include "LauncherStub.h"
+
+#include <vector>
+
+using namespace microvolution;
+
+static int userIterations = 0;
+
+static void countIterations(DeconvolutionCallbackStruct, void* p)
+{
+	++*static_cast<int*>(p);
+}
+
+static DeconParameters makeParameters()
+{
+	DeconParameters params;
+	params.nx = 8;
+	params.ny = 6;
+	params.nz = 4;
+	params.iterations = 3;
+	params.dr = 100;
+	params.dz = 250;
+	params.generatePsf = true;
+	return params;
+}
+
+// Generated PSF: built once, then passed back as an empirical PSF on every timepoint
+static void generatedPsf()
+{
+	stub::Reset();
+	DeconParameters params = makeParameters();
+	decon::CachedPsfLauncher series(params);
+	series.SetCallbacks(countIterations, nullptr, &userIterations);
+
+	const size_t n = (size_t)params.nx * params.ny * params.nz;
+	std::vector<float> img(n), out(n);
+	const float* psf = nullptr;
+	for (int t = 0; t < 3; ++t) {
+		for (size_t i = 0; i < n; ++i)
+			img[i] = (float)(t * 100 + i);
+		series.Run(img.data());
+
+		CHECK(stub::calls.makePsf == 1);
+		CHECK(!stub::calls.lastGeneratePsf);
+		CHECK(stub::calls.lastPsf != nullptr);
+		if (t == 0)
+			psf = stub::calls.lastPsf;
+		CHECK(stub::calls.lastPsf == psf);
+
+		series.RetrieveImage(out.data());
+		CHECK(out[5] == 2 * img[5]);
+	}
+
+	// The caller's parameters are left as they were
+	CHECK(params.generatePsf);
+	CHECK(params.psfNx == 0 && params.psfNy == 0 && params.psfNz == 0);
+	CHECK(params.psfDr == 0 && params.psfDz == 0);
+	CHECK(stub::calls.setParameters == 3 && stub::calls.run == 3);
+	CHECK(series.Timepoints() == 3);
+	CHECK(series.Iterations() == std::vector<int>(3, 3));
+	CHECK(userIterations == 9);
+
+	std::vector<uint16_t> slice((size_t)params.nx * params.ny);
+	series.RetrieveImageSlice(1, slice.data());
+	CHECK(slice[0] == (uint16_t)(2 * img[params.nx * params.ny]));
+}
+
+// Empirical PSF: copied once on construction, never generated
+static void empiricalPsf()
+{
+	stub::Reset();
+	DeconParameters params = makeParameters();
+	params.generatePsf = false;
+	params.psfNx = 3; params.psfNy = 3; params.psfNz = 3;
+	std::vector<float> psf(27, 1.0f);
+	decon::CachedPsfLauncher series(params, psf.data());
+
+	std::vector<float> img((size_t)params.nx * params.ny * params.nz, 1.0f);
+	series.Run(img.data());
+	series.Run(img.data());
+	CHECK(stub::calls.makePsf == 0);
+	CHECK(stub::calls.lastPsf != nullptr && stub::calls.lastPsf != psf.data());
+}
+
+// Light-sheet and tiled runs are not cached: the launcher generates the PSF itself, as with plain SetParameters()
+static void uncachedPsf(DeconParameters& params)
+{
+	stub::Reset();
+	decon::CachedPsfLauncher series(params);
+
+	std::vector<float> img((size_t)params.nx * params.ny * params.nz, 1.0f);
+	for (int t = 0; t < 2; ++t) {
+		series.Run(img.data());
+		CHECK(stub::calls.makePsf == 0);
+		CHECK(stub::calls.lastGeneratePsf);
+		CHECK(stub::calls.lastPsf == nullptr);
+	}
+	CHECK(stub::calls.run == 2);
+	CHECK(params.generatePsf);
+}
+
+static void lightSheetPsf()
+{
+	LightSheetParameters params;
+	static_cast<DeconParameters&>(params) = makeParameters();
+	params.lightSheetNA = 0.1f;
+	uncachedPsf(params);
+}
+
+static void tiledPsf()
+{
+	DeconParameters params = makeParameters();
+	params.zTiles = 2;
+	uncachedPsf(params);
+}
+
+static void missingPsf()
+{
+	stub::Reset();
+	DeconParameters params = makeParameters();
+	params.generatePsf = false;
+	decon::CachedPsfLauncher series(params);
+
+	std::vector<float> img((size_t)params.nx * params.ny * params.nz);
+	bool thrown = false;
+	try {
+		series.Run(img.data());
+	}
+	catch (microvolution_exception& e) {
+		thrown = e.getError() == MicrovolutionError::noPSF;
+	}
+	CHECK(thrown);
+	CHECK(stub::calls.run == 0);
+}
+
+int main()
+{
+	generatedPsf();
+	empiricalPsf();
+	lightSheetPsf();
+	tiledPsf();
+	missingPsf();
+	return checkFailures ? 1 : 0;
+}
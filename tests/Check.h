@@ -0,0 +1,14 @@
+#pragma once
+
+#include <iostream>
+
+// Minimal assertion helper for the GPU-free tests: report and count failures, keep going.
+static int checkFailures = 0;
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK failed: " #cond << std::endl; \
+			++checkFailures; \
+		} \
+	} while (0)
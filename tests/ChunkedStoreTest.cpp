@@ -0,0 +1,230 @@
+#include "ChunkedStore.h"
+#include "MVExceptions.h"
+
+#include "Check.h"
+#include "LauncherStub.h"
+
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+using namespace microvolution;
+
+static std::string root;
+
+static std::string readFile(const std::string& path)
+{
+	std::ifstream f(path, std::ios::binary);
+	return std::string(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+}
+
+//! Decompress one chunk file; empty if missing or corrupt.
+static std::vector<uint16_t> readChunk(const std::string& path, size_t values)
+{
+	const std::string compressed = readFile(path);
+	std::vector<uint16_t> out(values);
+	uLongf len = (uLongf)(values * sizeof(uint16_t));
+	if (compressed.empty() || uncompress(reinterpret_cast<Bytef*>(out.data()), &len, reinterpret_cast<const Bytef*>(compressed.data()), (uLong)compressed.size()) != Z_OK
+		|| len != values * sizeof(uint16_t))
+		out.clear();
+	return out;
+}
+
+static uint16_t value(int t, int z, int y, int x) { return (uint16_t)(t * 10000 + z * 1000 + y * 10 + x % 10); }
+
+static std::vector<uint16_t> makeSlice(int t, int z, int ny, int nx)
+{
+	std::vector<uint16_t> s((size_t)ny * nx);
+	for (int y = 0; y < ny; ++y)
+		for (int x = 0; x < nx; ++x)
+			s[(size_t)y * nx + x] = value(t, z, y, x);
+	return s;
+}
+
+template <typename F>
+static bool throws(F f)
+{
+	try {
+		f();
+	}
+	catch (microvolution_exception&) {
+		return true;
+	}
+	return false;
+}
+
+// Round trip with edge chunks in every dimension, slices out of order and a replaced slice
+static void roundTrip()
+{
+	const std::string path = root + "/roundtrip.zarr";
+	const int nt = 2, nz = 5, ny = 50, nx = 70, cz = 2, cy = 32, cx = 32;
+	{
+		decon::ChunkedStore store(path, nt, nz, ny, nx, cz, cy, cx, 3, 1, 1);
+		for (int t = 0; t < nt; ++t)
+			for (int z = nz - 1; z >= 0; --z) {
+				if (z == 1)
+					store.WriteSlice(t, 1, makeSlice(t, 0, ny, nx).data());	// wrong data first, replaced below
+				store.WriteSlice(t, z, makeSlice(t, z, ny, nx).data());
+			}
+		store.Flush();
+	}
+
+	const std::string meta = readFile(path + "/.zarray");
+	CHECK(meta.find("\"chunks\": [1, 2, 32, 32]") != std::string::npos);
+	CHECK(meta.find("\"shape\": [2, 5, 50, 70]") != std::string::npos);
+	CHECK(meta.find("\"dtype\": \"<u2\"") != std::string::npos);
+	CHECK(meta.find("\"compressor\": {\"id\": \"zlib\", \"level\": 1}") != std::string::npos);
+	CHECK(meta.find("\"dimension_separator\": \".\"") != std::string::npos);
+	CHECK(meta.find("\"fill_value\": 0") != std::string::npos);
+	CHECK(meta.find("\"order\": \"C\"") != std::string::npos);
+	CHECK(meta.find("\"zarr_format\": 2") != std::string::npos);
+
+	int files = 0;
+	for (auto& entry : std::filesystem::directory_iterator(path))
+		files += entry.path().filename() != ".zarray";
+	CHECK(files == nt * 3 * 2 * 3);
+
+	for (int t = 0; t < nt; ++t)
+		for (int zc = 0; zc < 3; ++zc)
+			for (int yc = 0; yc < 2; ++yc)
+				for (int xc = 0; xc < 3; ++xc) {
+					std::ostringstream name;
+					name << path << "/" << t << "." << zc << "." << yc << "." << xc;
+					const std::vector<uint16_t> chunk = readChunk(name.str(), (size_t)cz * cy * cx);
+					CHECK(!chunk.empty());
+					if (chunk.empty())
+						continue;
+
+					bool ok = true;
+					for (int z = 0; z < cz; ++z)
+						for (int y = 0; y < cy; ++y)
+							for (int x = 0; x < cx; ++x) {
+								const int gz = zc * cz + z, gy = yc * cy + y, gx = xc * cx + x;
+								// Edge chunks are padded with fill_value
+								const uint16_t expected = gz < nz && gy < ny && gx < nx ? value(t, gz, gy, gx) : 0;
+								ok = ok && chunk[((size_t)z * cy + y) * cx + x] == expected;
+							}
+					CHECK(ok);
+				}
+}
+
+// A slice written twice must not complete its slab, and writing into a submitted slab is rejected
+static void duplicateSlices()
+{
+	decon::ChunkedStore store(root + "/duplicates.zarr", 1, 4, 8, 8, 4, 8, 8, 1);
+	std::vector<uint16_t> s = makeSlice(0, 0, 8, 8);
+	store.WriteSlice(0, 0, s.data());
+	store.WriteSlice(0, 0, s.data());
+	store.WriteSlice(0, 1, s.data());
+	store.WriteSlice(0, 2, s.data());
+	CHECK(throws([&]() { store.Flush(); }));
+	CHECK(!std::filesystem::exists(root + "/duplicates.zarr/0.0.0.0"));
+
+	store.WriteSlice(0, 3, s.data());
+	store.Flush();
+	CHECK(std::filesystem::exists(root + "/duplicates.zarr/0.0.0.0"));
+	CHECK(throws([&]() { store.WriteSlice(0, 3, s.data()); }));
+}
+
+static void partialSlab()
+{
+	decon::ChunkedStore store(root + "/partial.zarr", 1, 4, 8, 8, 4, 8, 8, 1);
+	store.WriteSlice(0, 0, makeSlice(0, 0, 8, 8).data());
+	CHECK(throws([&]() { store.Flush(); }));
+}
+
+// Many slabs through one encoder with a single slab in flight: WriteSlice blocks rather than queueing everything
+static void backpressure()
+{
+	const std::string path = root + "/backpressure.zarr";
+	const int nt = 20, nz = 8, ny = 64, nx = 64;
+	decon::ChunkedStore store(path, nt, nz, ny, nx, 2, 16, 16, 1, 9, 1);
+	for (int t = 0; t < nt; ++t)
+		for (int z = 0; z < nz; ++z)
+			store.WriteSlice(t, z, makeSlice(t, z, ny, nx).data());
+	store.Flush();
+
+	int files = 0;
+	for (auto& entry : std::filesystem::directory_iterator(path))
+		files += entry.path().filename() != ".zarray";
+	CHECK(files == nt * 4 * 4 * 4);
+}
+
+// Rerunning into the same directory drops the earlier chunks but leaves other files alone
+static void rerun()
+{
+	const std::string path = root + "/rerun.zarr";
+	{
+		decon::ChunkedStore store(path, 2, 2, 8, 8, 2, 8, 8, 1);
+		for (int t = 0; t < 2; ++t)
+			for (int z = 0; z < 2; ++z)
+				store.WriteSlice(t, z, makeSlice(t, z, 8, 8).data());
+	}
+	std::ofstream(path + "/notes.txt") << "kept";
+	CHECK(std::filesystem::exists(path + "/1.0.0.0"));
+
+	{
+		decon::ChunkedStore store(path, 1, 2, 8, 8, 2, 8, 8, 1);
+		CHECK(!std::filesystem::exists(path + "/0.0.0.0"));
+		CHECK(!std::filesystem::exists(path + "/1.0.0.0"));
+		store.WriteSlice(0, 0, makeSlice(0, 0, 8, 8).data());
+		store.WriteSlice(0, 1, makeSlice(0, 1, 8, 8).data());
+	}
+	CHECK(std::filesystem::exists(path + "/0.0.0.0"));
+	CHECK(!std::filesystem::exists(path + "/1.0.0.0"));
+	CHECK(readFile(path + "/notes.txt") == "kept");
+}
+
+static void badLevel()
+{
+	const std::string path = root + "/badlevel.zarr";
+	CHECK(throws([&]() { decon::ChunkedStore store(path, 1, 1, 8, 8, 1, 8, 8, 1, 10); }));
+	CHECK(throws([&]() { decon::ChunkedStore store(path, 1, 1, 8, 8, 1, 8, 8, 1, -2); }));
+	CHECK(!std::filesystem::exists(path));
+}
+
+// WriteVolume pulls U16 slices from the launcher and refuses other scaling
+static void fromLauncher()
+{
+	stub::Reset();
+	DeconParameters params;
+	params.nx = 16; params.ny = 8; params.nz = 3;
+	params.scaling = Scaling::U16;
+
+	DeconvolutionLauncher launcher;
+	launcher.SetParameters(params);
+	for (int z = 0; z < params.nz; ++z)
+		launcher.SetImageSlice(z, makeSlice(0, z, params.ny, params.nx).data());
+
+	const std::string path = root + "/launcher.zarr";
+	decon::ChunkedStore store(path, 1, params.nz, params.ny, params.nx, 2, 8, 16, 2);
+	store.WriteVolume(0, launcher, params);
+	store.Flush();
+	const std::vector<uint16_t> first = readChunk(path + "/0.0.0.0", 2 * 8 * 16);
+	CHECK(first.size() == 2 * 8 * 16 && first[16 * 8 + 3] == value(0, 1, 0, 3));
+	const std::vector<uint16_t> last = readChunk(path + "/0.1.0.0", 2 * 8 * 16);
+	CHECK(last.size() == 2 * 8 * 16 && last[5] == value(0, 2, 0, 5) && last[16 * 8 + 5] == 0);
+
+	params.scaling = Scaling::None;
+	CHECK(throws([&]() { store.WriteVolume(0, launcher, params); }));
+}
+
+int main(int argc, char** argv)
+{
+	root = argc > 1 ? argv[1] : (std::filesystem::temp_directory_path() / "chunkedstore-data").string();
+	std::filesystem::remove_all(root);
+
+	roundTrip();
+	duplicateSlices();
+	partialSlab();
+	backpressure();
+	rerun();
+	badLevel();
+	fromLauncher();
+	return checkFailures ? 1 : 0;
+}
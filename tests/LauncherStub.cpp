@@ -0,0 +1,146 @@
+#include "LauncherStub.h"
+
+#include "DeconvolutionLauncher.h"
+#include "LightSheetParameters.h"
+#include "MVExceptions.h"
+
+#include <algorithm>
+#include <string.h>
+
+using namespace microvolution;
+
+namespace stub {
+
+	Calls calls;
+
+	namespace {
+		std::vector<float> image;
+		int nx, ny, nz, iterations;
+		Scaling::Type scaling;
+		IterationCallbackType iterationCallback;
+		StateCallbackType stateCallback;
+		void* userData;
+	}
+
+	void Reset()
+	{
+		calls = Calls{ 0, 0, 0, false, nullptr, 0 };
+		image.clear();
+	}
+}
+
+using namespace stub;
+
+namespace microvolution {
+
+	DeconParameters::DeconParameters()
+		: nx(0), ny(0), nz(0), iterations(0), xPadding(0), yPadding(0), zPadding(0), xTiles(0), yTiles(0), zTiles(0),
+		  lambda(0), dr(0), dz(0), NA(0), RI(0), ns(0), zdepth(0), imagingUp(false), pinhole(0),
+		  psfType(PSFType::Widefield), psfModel(PSFModel::BornWolf), generatePsf(false), blind(false), scaling(Scaling::None),
+		  preFilter(PreFilter::None), postFilter(PostFilter::None), regularizationType(RegularizationType::None), regularization(0),
+		  background(0), psfNx(0), psfNy(0), psfNz(0), psfDr(0), psfDz(0)
+	{
+	}
+
+	DeconParameters::~DeconParameters() {}
+
+	LightSheetParameters::LightSheetParameters() : lightSheetNA(0), lightSheetDirection(LightSheetDirection::LeftRight) {}
+	LightSheetParameters::~LightSheetParameters() {}
+
+	microvolution_exception::microvolution_exception(const std::string& _Message, MicrovolutionError::Type _error) : std::runtime_error(_Message), error(_error) {}
+	microvolution_exception::microvolution_exception(const char* _Message, MicrovolutionError::Type _error) : std::runtime_error(_Message), error(_error) {}
+	MicrovolutionError::Type microvolution_exception::getError() { return error; }
+
+	DeconvolutionLauncher::DeconvolutionLauncher() : impl(nullptr) {}
+	DeconvolutionLauncher::~DeconvolutionLauncher() {}
+
+	void DeconvolutionLauncher::SetDevice(int) {}
+
+	void DeconvolutionLauncher::SetCallbacks(IterationCallbackType callback, StateCallbackType stateCallback, void* pUserData)
+	{
+		iterationCallback = callback;
+		stub::stateCallback = stateCallback;
+		userData = pUserData;
+	}
+
+	void DeconvolutionLauncher::MakePSF(DeconParameters& params, float* psf)
+	{
+		++calls.makePsf;
+		const size_t n = (size_t)params.psfNx * params.psfNy * params.psfNz;
+		for (size_t i = 0; i < n; ++i)
+			psf[i] = (float)i;
+	}
+
+	void DeconvolutionLauncher::SetParameters(DeconParameters& params)
+	{
+		++calls.setParameters;
+		calls.lastGeneratePsf = params.generatePsf;
+		calls.lastPsf = nullptr;
+		nx = params.nx; ny = params.ny; nz = std::max(params.nz, 1);
+		iterations = params.iterations;
+		scaling = params.scaling;
+		image.assign((size_t)nx * ny * nz, 0);
+	}
+
+	void DeconvolutionLauncher::SetParameters(DeconParameters& params, float* img, float* psf)
+	{
+		SetParameters(params);
+		calls.lastPsf = psf;
+		std::copy(img, img + image.size(), image.begin());
+	}
+
+	void DeconvolutionLauncher::SetImageSlice(int i, float* ptr)
+	{
+		std::copy(ptr, ptr + (size_t)nx * ny, &image[(size_t)i * nx * ny]);
+	}
+
+	void DeconvolutionLauncher::SetImageSlice(int i, uint16_t* ptr)
+	{
+		std::copy(ptr, ptr + (size_t)nx * ny, &image[(size_t)i * nx * ny]);
+	}
+
+	void DeconvolutionLauncher::Run()
+	{
+		++calls.run;
+		if (stub::stateCallback) stub::stateCallback(DeconvolutionState::Init, userData);
+		if (stub::stateCallback) stub::stateCallback(DeconvolutionState::Running, userData);
+		for (int i = 0; i < iterations; ++i) {
+			++calls.iterationCallbacks;
+			if (iterationCallback)
+				iterationCallback(DeconvolutionCallbackStruct{ i, 0 }, userData);
+		}
+		for (float& v : image)
+			v *= 2;
+		if (stub::stateCallback) stub::stateCallback(DeconvolutionState::Cleanup, userData);
+		if (stub::stateCallback) stub::stateCallback(DeconvolutionState::Finished, userData);
+	}
+
+	std::vector<int> DeconvolutionLauncher::LastRunIterations()
+	{
+		return std::vector<int>(1, iterations);
+	}
+
+	void DeconvolutionLauncher::RetrieveImage(float* ptr)
+	{
+		std::copy(image.begin(), image.end(), ptr);
+	}
+
+	void DeconvolutionLauncher::RetrieveImageSlice(int i, float* ptr)
+	{
+		std::copy(&image[(size_t)i * nx * ny], &image[(size_t)i * nx * ny] + (size_t)nx * ny, ptr);
+	}
+
+	void DeconvolutionLauncher::RetrieveImageSlice(int i, uint16_t* ptr)
+	{
+		const float* src = &image[(size_t)i * nx * ny];
+		for (size_t k = 0; k < (size_t)nx * ny; ++k)
+			ptr[k] = (uint16_t)std::min(std::max(src[k], 0.0f), 65535.0f);
+	}
+
+	void DeconvolutionLauncher::RetrieveImageSlice(int i, uint8_t* ptr)
+	{
+		const float* src = &image[(size_t)i * nx * ny];
+		for (size_t k = 0; k < (size_t)nx * ny; ++k)
+			ptr[k] = (uint8_t)std::min(std::max(src[k], 0.0f), 255.0f);
+	}
+}
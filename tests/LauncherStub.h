@@ -0,0 +1,23 @@
+#pragma once
+
+#include <vector>
+
+/*
+  Stand-in for the parts of libMicrovolution used by the client-side helpers, so they can be tested without a GPU or license.
+  Run() "deconvolves" by doubling the image and fires the iteration/state callbacks for params.iterations iterations.
+*/
+namespace stub {
+
+	struct Calls {
+		int makePsf;
+		int setParameters;
+		int run;
+		bool lastGeneratePsf;		//!< DeconParameters::generatePsf as seen by the last SetParameters()
+		const float* lastPsf;		//!< PSF pointer passed to the last SetParameters()
+		int iterationCallbacks;
+	};
+
+	extern Calls calls;
+
+	void Reset();
+}
@@ -0,0 +1,132 @@
+#include "Trace.h"
+
+#include "Check.h"
+#include "LauncherStub.h"
+
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace microvolution;
+
+static std::string root;
+
+static std::string readFile(const std::string& path)
+{
+	std::ifstream f(path, std::ios::binary);
+	return std::string(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+}
+
+static int count(const std::string& text, const std::string& what)
+{
+	int n = 0;
+	for (size_t pos = text.find(what); pos != std::string::npos; pos = text.find(what, pos + 1))
+		++n;
+	return n;
+}
+
+// Nothing is recorded while tracing is off, and naming a thread then does not register it
+static void disabled()
+{
+	CHECK(!decon::Trace::Enabled());
+	std::thread([]() {
+		decon::Trace::SetThreadName("idle thread");
+		decon::Trace::Scope scope("ignored");
+		decon::Trace::Bytes("ignored bytes", 1);
+	}).join();
+
+	const std::string path = root + "-disabled.json";
+	decon::Trace::Enable(path);
+	decon::Trace::Disable();
+	const std::string json = readFile(path);
+	CHECK(json.find("traceEvents") != std::string::npos);
+	CHECK(json.find("idle thread") == std::string::npos);
+	CHECK(json.find("ignored") == std::string::npos);
+}
+
+// Counters from several threads add up to one running total per name
+static void counters()
+{
+	const std::string path = root + "-counters.json";
+	decon::Trace::Enable(path);
+	std::vector<std::thread> threads;
+	for (int t = 0; t < 4; ++t)
+		threads.emplace_back([]() {
+			decon::Trace::SetThreadName("worker");
+			for (int i = 0; i < 5; ++i) {
+				decon::Trace::Scope scope("work", "test", i);
+				decon::Trace::Bytes("bytes written", 10);
+			}
+		});
+	for (auto& t : threads)
+		t.join();
+	decon::Trace::Disable();
+
+	const std::string json = readFile(path);
+	CHECK(count(json, "\"name\":\"work\"") == 20);
+	CHECK(count(json, "\"ph\":\"C\"") == 20);
+	CHECK(count(json, "\"bytes\":200}") == 1);
+	CHECK(count(json, "\"bytes\":210}") == 0);
+	CHECK(count(json, "\"args\":{\"name\":\"worker\"}") == 4);
+
+	// Exited worker threads are pruned after export and do not reappear
+	const std::string again = root + "-again.json";
+	decon::Trace::Enable(again);
+	decon::Trace::Disable();
+	CHECK(readFile(again).find("worker") == std::string::npos);
+}
+
+// Launcher wrappers record a span per slice and the bytes moved; iteration callbacks become spans
+static void launcher()
+{
+	stub::Reset();
+	DeconParameters params;
+	params.nx = 4; params.ny = 4; params.nz = 2; params.iterations = 3;
+
+	const std::string path = root + "-launcher.json";
+	decon::Trace::Enable(path);
+
+	DeconvolutionLauncher launcher;
+	decon::Trace::TracedCallbacks traced;
+	launcher.SetCallbacks(decon::Trace::TracedCallbacks::Iteration, decon::Trace::TracedCallbacks::State, &traced);
+
+	std::vector<float> slice(16, 1.0f);
+	decon::Trace::SetParameters(launcher, params);
+	for (int z = 0; z < params.nz; ++z)
+		decon::Trace::SetImageSlice(launcher, params, z, slice.data());
+	decon::Trace::Run(launcher);
+	for (int z = 0; z < params.nz; ++z)
+		decon::Trace::RetrieveImageSlice(launcher, params, z, slice.data());
+	decon::Trace::Disable();
+
+	CHECK(slice[0] == 2.0f);
+	const std::string json = readFile(path);
+	CHECK(count(json, "\"name\":\"SetImageSlice\"") == 2);
+	CHECK(count(json, "\"name\":\"RetrieveImageSlice\"") == 2);
+	CHECK(count(json, "\"name\":\"iteration\"") == 3);
+	CHECK(count(json, "\"name\":\"subvolume\"") == 1);
+	CHECK(count(json, "\"name\":\"Running\"") == 1);
+	CHECK(count(json, "\"bytes\":128}") == 2);	// 2 slices * 16 floats, each way
+}
+
+static void unwritable()
+{
+	decon::Trace::Enable(root + "-missing-dir/trace.json");
+	{
+		decon::Trace::Scope scope("lost");
+	}
+	decon::Trace::Disable();	// reports to std::cerr
+	CHECK(!decon::Trace::Enabled());
+}
+
+int main(int argc, char** argv)
+{
+	root = argc > 1 ? argv[1] : "trace-test";
+	disabled();
+	counters();
+	launcher();
+	unwritable();
+	return checkFailures ? 1 : 0;
+}